@@ -29,6 +29,9 @@
 
 
 
+#define CMSendBufferRetainedSize (64U<<10) /* 64 KiB */
+#define CMRecordGrowthSize (4U<<10) /* 4 KiB */
+
 #if DEBUG
 #define DEBUGF(format,...) printf(format, __VA_ARGS__)
 #else
@@ -39,10 +42,46 @@ struct _communicationDescriptionContext {
 	int socket;
 	int communicationDescriptor;
 	xdrproc_t converterf;
-	XDR xdrs;
+	char *sendBuffer;
+	size_t sendBufferCapacity;
+	struct _communicationFlowControl *flowControl;
 };
 typedef struct _communicationDescriptionContext CMCommunicationDescriptionContext;
 
+struct _communicationRecord {
+	struct _communicationRecord *next;
+	char *record;
+	size_t length;
+	int error;
+};
+typedef struct _communicationRecord CMCommunicationRecord;
+
+/* Receive limits and credits of a communication descriptor. Allocated apart from the context so that its address stays valid when the contexts are reallocated. */
+struct _communicationFlowControl {
+	int socket;
+	size_t maximumRecordSize;
+	size_t maximumDecodedSize;
+	unsigned int window;
+	unsigned int credits; /* records we may still send */
+	unsigned int consumed; /* records received whose credit is not yet returned */
+	unsigned int owed; /* credits due to the peer, written by whoever holds writeMutex next */
+	int reading; /* a thread is reading the socket */
+	unsigned int stashed; /* records read while waiting for credits */
+	CMCommunicationRecord *head;
+	CMCommunicationRecord *tail;
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	pthread_mutex_t writeMutex;
+};
+typedef struct _communicationFlowControl CMCommunicationFlowControl;
+
+struct _communicationDecodeLimits {
+	XDR *xdrs;
+	size_t length;
+	size_t maximumDecodedSize;
+};
+typedef struct _communicationDecodeLimits CMCommunicationDecodeLimits;
+
 struct _communicationInternalData {
 	CMCommunicationDescriptionContext *CMCommunicationContexts;
 	unsigned int capacity;
@@ -51,14 +90,89 @@ struct _communicationInternalData {
 typedef struct _communicationInternalData CMCommunicationInternalData;
 
 static CMCommunicationInternalData CMInternalData = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+static pthread_once_t CMDecodeLimitsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t CMDecodeLimitsKey;
 
-#if defined(__APPLE__) && defined(__MACH__)
-static int readit(void *handler, void *buffer, int nbytes);
-static int writeit(void *handler, void *buffer, int nbytes);
-#else
-static int readit(char *handler, char *buffer, int nbytes);
-static int writeit(char *handler, char *buffer, int nbytes);
-#endif
+struct _receivePipelineJob {
+	struct _receivePipelineJob *next;
+	struct _receivePipelineJob *previous;
+	struct _receivePipelineSource *source;
+	unsigned long sequence;
+	char *record;
+	size_t length;
+	xdrproc_t converterf;
+	void *message;
+	int error;
+};
+typedef struct _receivePipelineJob CMReceivePipelineJob;
+
+struct _receivePipelineDeque {
+	CMReceivePipeline *pipeline;
+	unsigned int index;
+	CMReceivePipelineJob *head;
+	CMReceivePipelineJob *tail;
+	pthread_mutex_t mutex;
+};
+typedef struct _receivePipelineDeque CMReceivePipelineDeque;
+
+struct _receivePipelineSource {
+	struct _receivePipelineSource *next;
+	CMReceivePipeline *pipeline;
+	int communicationDescriptor;
+	CMCommunicationFlowControl *flowControl;
+	pthread_t thread;
+	char *record; /* read and not yet queued */
+	size_t length;
+	int error;
+	int held;
+	CMCommunicationRecord *records; /* taken over from the communication descriptor */
+	unsigned long backlog; /* records read and not yet delivered */
+	unsigned long nextSequence;
+	unsigned long nextDelivery;
+	CMReceivePipelineJob *pending;
+};
+typedef struct _receivePipelineSource CMReceivePipelineSource;
+
+struct _receivePipeline {
+	size_t messageSize;
+	int ordered;
+	unsigned int backlog;
+	unsigned int workerCount;
+	unsigned int runningWorkers;
+	pthread_t *workers;
+	CMReceivePipelineDeque *deques;
+	CMReceivePipelineSource *sources;
+	CMReceivePipelineJob *head; /* decoded messages, ready to be delivered */
+	CMReceivePipelineJob *tail;
+	unsigned long queued;
+	unsigned long outstanding;
+	unsigned int readers;
+	int stopping;
+	pthread_mutex_t mutex;
+	pthread_cond_t workAvailable;
+	pthread_cond_t messageAvailable;
+	pthread_cond_t backlogAvailable;
+};
+
+static int writeall(int socket, const char *buffer, size_t nbytes);
+static void CMTrimSendBuffer(CMCommunicationDescriptionContext *context);
+static int readall(int socket, char *buffer, size_t nbytes);
+static int readrecord(int socket, size_t maximumRecordSize, char **record, size_t *length);
+static int discardrecord(char **record);
+
+static int CMFlowControlNextRecord(CMCommunicationFlowControl *flowControl, char **record, size_t *length);
+static int CMFlowControlAcquireCredit(CMCommunicationFlowControl *flowControl);
+static void CMFlowControlConsumed(CMCommunicationFlowControl *flowControl);
+static void CMFlowControlReturnCredits(CMCommunicationFlowControl *flowControl);
+static void CMDecodeLimitsCreateKey(void);
+static CMCommunicationDecodeLimits *CMDecodeLimitsForStream(XDR *xdrs);
+static int CMDecodeRecord(xdrproc_t converterf, char *record, size_t length, size_t maximumDecodedSize, void *message);
+
+static void *CMReceivePipelineRead(void *source);
+static void *CMReceivePipelineWork(void *deque);
+static CMReceivePipelineJob *CMReceivePipelineTake(CMReceivePipeline *pipeline, unsigned int index);
+static void CMReceivePipelineDeliver(CMReceivePipeline *pipeline, CMReceivePipelineJob *job);
+static void CMReceivePipelineFreeJobs(CMReceivePipelineJob *job);
 
 bool_t xdr_digest(XDR *xdrs, CMCommunicationDescriptionContext *context);
 
@@ -106,16 +220,21 @@ int CMInitCommunicationWithSocketAndConverter(int socket, xdrproc_t converterf)
 		CMInternalData.capacity = newCapacity;
 	}
 	
+	CMCommunicationFlowControl *flowControl = calloc(1, sizeof(CMCommunicationFlowControl));
+	if ( flowControl == NULL ) return pthread_mutex_unlock(mutex), errno = ENOMEM, -1;
+	flowControl->socket = socket;
+	pthread_mutex_init(&flowControl->mutex, NULL);
+	pthread_cond_init(&flowControl->condition, NULL);
+	pthread_mutex_init(&flowControl->writeMutex, NULL);
+	
 	/* Initialization */
 	CMCommunicationDescriptionContext *context = &(communicationContexts[index]);
 	context->socket = socket;
 	context->converterf = converterf;
 	context->communicationDescriptor = (int)index;
-#if defined(__APPLE__) && defined(__MACH__)
-	xdrrec_create( &(context->xdrs), 0, 0, (void *)context, readit, writeit);
-#else
-	xdrrec_create( &(context->xdrs), 0, 0, (void *)context, (int (*)(char*,char*,int))readit, (int (*)(char*,char*,int))writeit);
-#endif
+	context->sendBuffer = NULL;
+	context->sendBufferCapacity = 0;
+	context->flowControl = flowControl;
 	
 	pthread_cleanup_pop(0);
 	pthread_mutex_unlock(mutex);
@@ -134,7 +253,21 @@ void CMFinishCommunicationWithCommunicationDescriptor(int communicationDescripto
 	if (context->communicationDescriptor != communicationDescriptor) { return; };
 	context->socket = -1;
 	context->communicationDescriptor = -1;
-	xdr_destroy(&context->xdrs);
+	free(context->sendBuffer);
+	context->sendBuffer = NULL;
+	context->sendBufferCapacity = 0;
+	CMCommunicationFlowControl *flowControl = context->flowControl;
+	context->flowControl = NULL;
+	while ( flowControl->head != NULL ) {
+		CMCommunicationRecord *record = flowControl->head;
+		flowControl->head = record->next;
+		free(record->record);
+		free(record);
+	}
+	pthread_mutex_destroy(&flowControl->writeMutex);
+	pthread_cond_destroy(&flowControl->condition);
+	pthread_mutex_destroy(&flowControl->mutex);
+	free(flowControl);
 	
 	/* If by any chance the array is empty free it */
 	unsigned int i;
@@ -148,6 +281,10 @@ void CMFinishCommunicationWithCommunicationDescriptor(int communicationDescripto
 }
 
 int CMSendMessage(int communicationDescriptor, void *message) {
+	return CMSendMessageWithSizeHint(communicationDescriptor, message, 0);
+}
+
+int CMSendMessageWithSizeHint(int communicationDescriptor, void *message, size_t sizeHint) {
 	if ( message == NULL ) return  errno = EINVAL, -1;
 	if ( CMInternalData.capacity < UINT_MAX && (unsigned int)communicationDescriptor >= CMInternalData.capacity) return errno = EINVAL, -1;
 	
@@ -161,12 +298,59 @@ int CMSendMessage(int communicationDescriptor, void *message) {
 //	CC_SHA1((const unsigned char *)line->content, size, line->id);
 //	SHA1((const unsigned char *)line->content, size, line->id);
 	
-	XDR *xdrs = &(context->xdrs);
-	xdrs->x_op = XDR_ENCODE;
-	bool_t result = context->converterf(xdrs, message, 0);
-	if ( result == (TRUE) )
-		return (xdrrec_endofrecord(xdrs, (TRUE) ) == 1) ? 0 : (errno = EINVAL, -1);
-	return -1;
+	/* The whole record is sent as a single last fragment: a 4 bytes record mark followed by the encoded message.
+	 * The encoded size is either the caller's hint or computed by a counting pass of the converter. */
+	const size_t markSize = 4;
+	const size_t maxFragmentSize = 0x7fffffffUL;
+	size_t size = sizeHint;
+	bool_t sized = (FALSE);
+	XDR xdrs;
+	for (;;) {
+		if ( size == 0 ) { /* 0 is also the size of an empty message, the encoding below tells them apart */
+			size = (size_t)xdr_sizeof(context->converterf, message);
+			sized = (TRUE);
+		}
+		if ( size > maxFragmentSize - 3 ) return errno = EINVAL, -1;
+		size = (size + 3) & ~(size_t)3; /* XDR units are 4 bytes long */
+		
+		if ( context->sendBufferCapacity < markSize + size ) {
+			char *newSendBuffer = realloc(context->sendBuffer, markSize + size);
+			if ( newSendBuffer == NULL ) return errno = ENOMEM, -1;
+			context->sendBuffer = newSendBuffer;
+			context->sendBufferCapacity = markSize + size;
+		}
+		
+		xdrmem_create(&xdrs, context->sendBuffer + markSize, (u_int)size, XDR_ENCODE);
+		bool_t result = context->converterf(&xdrs, message, 0);
+		if ( result == (TRUE) ) break;
+		xdr_destroy(&xdrs);
+		if ( sized ) return CMTrimSendBuffer(context), errno = EINVAL, -1;
+		size = 0; /* The hint was too small, fall back to the counting pass */
+	}
+	size_t length = (size_t)xdr_getpos(&xdrs);
+	xdr_destroy(&xdrs);
+	/* An empty record is a credit when flow control is enabled */
+	if ( length == 0 && context->flowControl->window > 0 ) return CMTrimSendBuffer(context), errno = EINVAL, -1;
+	
+	uint32_t mark = 0x80000000U | (uint32_t)length;
+	unsigned char *header = (unsigned char *)context->sendBuffer;
+	header[0] = (unsigned char)(mark >> 24), header[1] = (unsigned char)(mark >> 16), header[2] = (unsigned char)(mark >> 8), header[3] = (unsigned char)mark;
+	
+	CMCommunicationFlowControl *flowControl = context->flowControl;
+	if ( CMFlowControlAcquireCredit(flowControl) != 0 ) return CMTrimSendBuffer(context), -1;
+	pthread_mutex_lock(&flowControl->writeMutex);
+	int retval = writeall(context->socket, context->sendBuffer, markSize + length);
+	int error = errno;
+	pthread_mutex_unlock(&flowControl->writeMutex);
+	CMFlowControlReturnCredits(flowControl); /* Those owed while we were writing */
+	CMTrimSendBuffer(context);
+	return (retval == 0) ? 0 : (errno = error, -1);
+}
+
+static void CMTrimSendBuffer(CMCommunicationDescriptionContext *context) {
+	/* Only keep the buffer of small messages, a large one would be pinned for the life of the descriptor */
+	if ( context->sendBufferCapacity > CMSendBufferRetainedSize )
+		free(context->sendBuffer), context->sendBuffer = NULL, context->sendBufferCapacity = 0;
 }
 
 int CMReceiveMessage(int communicationDescriptor, void *message) {
@@ -182,13 +366,110 @@ int CMReceiveMessage(int communicationDescriptor, void *message) {
 	if (context->socket == -1) return errno = EINVAL, -1;
 	if (context->converterf == NULL) return errno = EINVAL, -1;
 
-	XDR *xdrs = &(context->xdrs);
-	xdrs->x_op = XDR_DECODE;
-	if ( xdrrec_skiprecord(xdrs) == (FALSE) ) return retval;
+	CMCommunicationFlowControl *flowControl = context->flowControl;
+	char *record = NULL;
+	size_t length = 0;
+	if ( CMFlowControlNextRecord(flowControl, &record, &length) != 0 ) {
+		free(record);
+		if ( errno == EMSGSIZE ) CMFlowControlConsumed(flowControl), errno = EMSGSIZE;
+		return retval;
+	}
+
+	retval = CMDecodeRecord(context->converterf, record, length, flowControl->maximumDecodedSize, message);
+	free(record);
+	CMFlowControlConsumed(flowControl);
+	return (retval == 0) ? 0 : (errno = retval, -1);
+}
 
-	if ( context->converterf(xdrs, message, 0)  == (TRUE) )
-		retval = 0;
-	return retval;
+int CMSetReceiveLimits(int communicationDescriptor, size_t maximumRecordSize, size_t maximumDecodedSize) {
+	if ( CMInternalData.capacity < UINT_MAX && (unsigned int)communicationDescriptor >= CMInternalData.capacity) return errno = EINVAL, -1;
+	
+	pthread_mutex_t *mutex = &CMInternalData.mutex;
+	pthread_mutex_lock(mutex);
+	
+	CMCommunicationDescriptionContext *communicationContexts = CMInternalData.CMCommunicationContexts;
+	CMCommunicationDescriptionContext *context = &(communicationContexts[communicationDescriptor]);
+	if (context->communicationDescriptor != communicationDescriptor) return pthread_mutex_unlock(mutex), errno = EINVAL, -1;
+	CMCommunicationFlowControl *flowControl = context->flowControl;
+	pthread_mutex_lock(&flowControl->mutex);
+	flowControl->maximumRecordSize = maximumRecordSize;
+	flowControl->maximumDecodedSize = maximumDecodedSize;
+	pthread_mutex_unlock(&flowControl->mutex);
+	
+	pthread_mutex_unlock(mutex);
+	return 0;
+}
+
+int CMSetFlowControlWindow(int communicationDescriptor, unsigned int window) {
+	if ( CMInternalData.capacity < UINT_MAX && (unsigned int)communicationDescriptor >= CMInternalData.capacity) return errno = EINVAL, -1;
+	
+	pthread_mutex_t *mutex = &CMInternalData.mutex;
+	pthread_mutex_lock(mutex);
+	
+	CMCommunicationDescriptionContext *communicationContexts = CMInternalData.CMCommunicationContexts;
+	CMCommunicationDescriptionContext *context = &(communicationContexts[communicationDescriptor]);
+	if (context->communicationDescriptor != communicationDescriptor) return pthread_mutex_unlock(mutex), errno = EINVAL, -1;
+	CMCommunicationFlowControl *flowControl = context->flowControl;
+	pthread_mutex_lock(&flowControl->mutex);
+	flowControl->window = window;
+	flowControl->credits = window;
+	flowControl->consumed = 0;
+	flowControl->owed = 0;
+	pthread_cond_broadcast(&flowControl->condition);
+	pthread_mutex_unlock(&flowControl->mutex);
+	
+	pthread_mutex_unlock(mutex);
+	return 0;
+}
+
+u_int CMDecodeLimit(XDR *xdrs) {
+	if ( xdrs == NULL ) return errno = EINVAL, 0;
+	CMCommunicationDecodeLimits *limits = CMDecodeLimitsForStream(xdrs);
+	if ( limits == NULL ) return UINT_MAX;
+	
+	/* A variable length item can not be longer than what is left of the record */
+	size_t position = (size_t)xdr_getpos(xdrs);
+	size_t limit = (position < limits->length) ? limits->length - position : 0;
+	if ( limits->maximumDecodedSize != 0 && limits->maximumDecodedSize < limit ) limit = limits->maximumDecodedSize;
+	return (limit > UINT_MAX) ? UINT_MAX : (u_int)limit;
+}
+
+u_int CMDecodeArrayLimit(XDR *xdrs, size_t elementSize, size_t elementWireSize) {
+	if ( xdrs == NULL || elementSize == 0 ) return errno = EINVAL, 0;
+	CMCommunicationDecodeLimits *limits = CMDecodeLimitsForStream(xdrs);
+	if ( limits == NULL ) return UINT_MAX;
+	
+	/* Each element takes at least one XDR unit of what is left of the record, and elementSize bytes once decoded */
+	if ( elementWireSize < BYTES_PER_XDR_UNIT ) elementWireSize = BYTES_PER_XDR_UNIT;
+	size_t position = (size_t)xdr_getpos(xdrs);
+	size_t limit = (position < limits->length) ? (limits->length - position) / elementWireSize : 0;
+	if ( limits->maximumDecodedSize != 0 && limits->maximumDecodedSize / elementSize < limit ) limit = limits->maximumDecodedSize / elementSize;
+	return (limit > UINT_MAX) ? UINT_MAX : (u_int)limit;
+}
+
+static void CMDecodeLimitsCreateKey(void) {
+	pthread_key_create(&CMDecodeLimitsKey, NULL);
+}
+
+static CMCommunicationDecodeLimits *CMDecodeLimitsForStream(XDR *xdrs) {
+	/* Limits only apply to the stream decoding a received record on this thread, any other stream belongs to the caller */
+	if ( xdrs->x_op != XDR_DECODE ) return NULL;
+	pthread_once(&CMDecodeLimitsOnce, CMDecodeLimitsCreateKey);
+	CMCommunicationDecodeLimits *limits = pthread_getspecific(CMDecodeLimitsKey);
+	return ( limits != NULL && limits->xdrs == xdrs ) ? limits : NULL;
+}
+
+static int CMDecodeRecord(xdrproc_t converterf, char *record, size_t length, size_t maximumDecodedSize, void *message) {
+	XDR xdrs;
+	CMCommunicationDecodeLimits limits = { &xdrs, length, maximumDecodedSize };
+	pthread_once(&CMDecodeLimitsOnce, CMDecodeLimitsCreateKey);
+	void *previous = pthread_getspecific(CMDecodeLimitsKey); /* A converter may itself receive a message */
+	pthread_setspecific(CMDecodeLimitsKey, &limits);
+	xdrmem_create(&xdrs, record, (u_int)length, XDR_DECODE);
+	bool_t result = converterf(&xdrs, message, 0);
+	xdr_destroy(&xdrs);
+	pthread_setspecific(CMDecodeLimitsKey, previous);
+	return (result == (TRUE)) ? 0 : EINVAL;
 }
 
 void CMDestroyMessage(void *message, xdrproc_t converter) {
@@ -197,6 +478,327 @@ void CMDestroyMessage(void *message, xdrproc_t converter) {
 }
 
 
+CMReceivePipeline *CMCreateReceivePipeline(unsigned int workers, unsigned int backlog, size_t messageSize, int ordered) {
+	if ( workers == 0 || backlog == 0 || messageSize == 0 ) return errno = EINVAL, (CMReceivePipeline *)NULL;
+	
+	CMReceivePipeline *pipeline = calloc(1, sizeof(CMReceivePipeline));
+	if ( pipeline == NULL ) return errno = ENOMEM, (CMReceivePipeline *)NULL;
+	pipeline->workers = calloc((size_t)workers, sizeof(pthread_t));
+	pipeline->deques = calloc((size_t)workers, sizeof(CMReceivePipelineDeque));
+	if ( pipeline->workers == NULL || pipeline->deques == NULL )
+		return free(pipeline->workers), free(pipeline->deques), free(pipeline), errno = ENOMEM, (CMReceivePipeline *)NULL;
+	
+	pipeline->messageSize = messageSize;
+	pipeline->ordered = ordered;
+	pipeline->backlog = backlog;
+	pipeline->workerCount = workers;
+	pthread_mutex_init(&pipeline->mutex, NULL);
+	pthread_cond_init(&pipeline->workAvailable, NULL);
+	pthread_cond_init(&pipeline->messageAvailable, NULL);
+	pthread_cond_init(&pipeline->backlogAvailable, NULL);
+	for (unsigned int i=0; i<workers; i++) {
+		CMReceivePipelineDeque *deque = &(pipeline->deques[i]);
+		deque->pipeline = pipeline;
+		deque->index = i;
+		pthread_mutex_init(&deque->mutex, NULL);
+	}
+	for (unsigned int i=0; i<workers; i++, pipeline->runningWorkers++)
+		if ( pthread_create(&(pipeline->workers[i]), NULL, CMReceivePipelineWork, &(pipeline->deques[i])) != 0 )
+			return CMDestroyReceivePipeline(pipeline), errno = EAGAIN, (CMReceivePipeline *)NULL;
+	
+	return pipeline;
+}
+
+void CMDestroyReceivePipeline(CMReceivePipeline *pipeline) {
+	if ( pipeline == NULL ) { errno = EINVAL; return; }
+	
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->stopping = 1;
+	pthread_cond_broadcast(&pipeline->workAvailable);
+	pthread_cond_broadcast(&pipeline->messageAvailable);
+	pthread_cond_broadcast(&pipeline->backlogAvailable);
+	pthread_mutex_unlock(&pipeline->mutex);
+	
+	/* Readers can only be cancelled while blocked on the socket */
+	for (CMReceivePipelineSource *source = pipeline->sources; source != NULL; source = source->next) {
+		pthread_cancel(source->thread), pthread_join(source->thread, NULL);
+		pthread_mutex_lock(&source->flowControl->mutex);
+		source->flowControl->reading = 0;
+		pthread_cond_broadcast(&source->flowControl->condition);
+		pthread_mutex_unlock(&source->flowControl->mutex);
+	}
+	for (unsigned int i=0; i<pipeline->runningWorkers; i++)
+		pthread_join(pipeline->workers[i], NULL);
+	
+	for (unsigned int i=0; i<pipeline->workerCount; i++)
+		CMReceivePipelineFreeJobs(pipeline->deques[i].head), pthread_mutex_destroy(&(pipeline->deques[i].mutex));
+	CMReceivePipelineFreeJobs(pipeline->head);
+	while ( pipeline->sources != NULL ) {
+		CMReceivePipelineSource *source = pipeline->sources;
+		pipeline->sources = source->next;
+		CMReceivePipelineFreeJobs(source->pending);
+		for (CMCommunicationRecord *next; source->records != NULL; source->records = next)
+			next = source->records->next, free(source->records->record), free(source->records), CMFlowControlConsumed(source->flowControl);
+		if ( source->held ) CMFlowControlConsumed(source->flowControl);
+		pthread_mutex_lock(&source->flowControl->mutex); /* Nothing else will be received, the last batch is returned as is */
+		source->flowControl->owed += source->flowControl->consumed, source->flowControl->consumed = 0;
+		pthread_mutex_unlock(&source->flowControl->mutex);
+		CMFlowControlReturnCredits(source->flowControl);
+		free(source->record);
+		free(source);
+	}
+	
+	pthread_cond_destroy(&pipeline->backlogAvailable);
+	pthread_cond_destroy(&pipeline->messageAvailable);
+	pthread_cond_destroy(&pipeline->workAvailable);
+	pthread_mutex_destroy(&pipeline->mutex);
+	free(pipeline->deques);
+	free(pipeline->workers);
+	free(pipeline);
+}
+
+int CMReceivePipelineAddCommunicationDescriptor(CMReceivePipeline *pipeline, int communicationDescriptor) {
+	if ( pipeline == NULL ) return errno = EINVAL, -1;
+	if ( CMInternalData.capacity < UINT_MAX && (unsigned int)communicationDescriptor >= CMInternalData.capacity) return errno = EINVAL, -1;
+	
+	CMCommunicationDescriptionContext *communicationContexts = CMInternalData.CMCommunicationContexts;
+	CMCommunicationDescriptionContext *context = &(communicationContexts[communicationDescriptor]);
+	
+	if (context->communicationDescriptor != communicationDescriptor) return errno = EINVAL, -1;
+	if (context->socket == -1) return errno = EINVAL, -1;
+	if (context->flowControl->window > pipeline->backlog) return errno = EINVAL, -1; /* The credits of our sends would wait behind undelivered records */
+	
+	CMReceivePipelineSource *source = calloc(1, sizeof(CMReceivePipelineSource));
+	if ( source == NULL ) return errno = ENOMEM, -1;
+	source->pipeline = pipeline;
+	source->communicationDescriptor = communicationDescriptor;
+	source->flowControl = context->flowControl;
+	
+	pthread_mutex_lock(&pipeline->mutex);
+	if ( pipeline->stopping ) return pthread_mutex_unlock(&pipeline->mutex), free(source), errno = EINVAL, -1;
+	if ( pthread_create(&source->thread, NULL, CMReceivePipelineRead, source) != 0 )
+		return pthread_mutex_unlock(&pipeline->mutex), free(source), errno = EAGAIN, -1;
+	source->next = pipeline->sources;
+	pipeline->sources = source;
+	pipeline->readers++;
+	pthread_mutex_unlock(&pipeline->mutex);
+	
+	return 0;
+}
+
+int CMReceivePipelineNextMessage(CMReceivePipeline *pipeline, int *communicationDescriptor, void *message) {
+	if ( pipeline == NULL || message == NULL ) return errno = EINVAL, -1;
+	
+	pthread_mutex_lock(&pipeline->mutex);
+	while ( pipeline->head == NULL ) {
+		if ( pipeline->stopping ) return pthread_mutex_unlock(&pipeline->mutex), errno = EINVAL, -1;
+		if ( pipeline->sources != NULL && pipeline->readers == 0 && pipeline->outstanding == 0 )
+			return pthread_mutex_unlock(&pipeline->mutex), errno = EPIPE, -1;
+		pthread_cond_wait(&pipeline->messageAvailable, &pipeline->mutex);
+	}
+	CMReceivePipelineJob *job = pipeline->head;
+	pipeline->head = job->next;
+	if ( pipeline->head == NULL ) pipeline->tail = NULL;
+	if ( job->source->backlog-- == pipeline->backlog ) pthread_cond_broadcast(&pipeline->backlogAvailable);
+	pthread_mutex_unlock(&pipeline->mutex);
+	
+	if ( communicationDescriptor != NULL ) *communicationDescriptor = job->source->communicationDescriptor;
+	int error = job->error;
+	if ( error == 0 ) memcpy(message, job->message, pipeline->messageSize);
+	CMFlowControlConsumed(job->source->flowControl);
+	free(job->message);
+	free(job);
+	return (error == 0) ? 0 : (errno = error, -1);
+}
+
+static void *CMReceivePipelineRead(void *arg) {
+	CMReceivePipelineSource *source = arg;
+	CMReceivePipeline *pipeline = source->pipeline;
+	CMCommunicationFlowControl *flowControl = source->flowControl;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	
+	/* Become the only reader of the socket and take over the records read while waiting for credits */
+	pthread_mutex_lock(&flowControl->mutex);
+	while ( flowControl->reading )
+		pthread_cond_wait(&flowControl->condition, &flowControl->mutex);
+	flowControl->reading = 1;
+	source->records = flowControl->head;
+	flowControl->head = flowControl->tail = NULL;
+	flowControl->stashed = 0;
+	pthread_mutex_unlock(&flowControl->mutex);
+	
+	for (;;) {
+		/* Stop reading while the consumer is behind, so that the socket pushes back on the sender. With flow control the
+		 * credits of our own sends may be queued behind the records of the peer: keep reading them, holding back one record. */
+		pthread_mutex_lock(&pipeline->mutex);
+		while ( source->backlog >= pipeline->backlog && (source->held || flowControl->window == 0) && pipeline->stopping == 0 )
+			pthread_cond_wait(&pipeline->backlogAvailable, &pipeline->mutex);
+		int stopping = pipeline->stopping;
+		int full = (source->backlog >= pipeline->backlog);
+		pthread_mutex_unlock(&pipeline->mutex);
+		if ( stopping ) break;
+		
+		if ( source->held == 0 ) {
+			source->length = 0, source->error = 0;
+			if ( source->records != NULL ) {
+				CMCommunicationRecord *record = source->records;
+				source->records = record->next;
+				source->record = record->record, source->length = record->length, source->error = record->error;
+				free(record);
+			}
+			else if ( readrecord(flowControl->socket, flowControl->maximumRecordSize, &(source->record), &(source->length)) != 0 ) {
+				if ( errno != EMSGSIZE ) break;
+				source->error = EMSGSIZE; /* Skipped, delivered as an error */
+			}
+			else if ( source->length == 0 && flowControl->window > 0 ) { /* A credit returned by the peer */
+				free(source->record), source->record = NULL;
+				pthread_mutex_lock(&flowControl->mutex);
+				flowControl->credits++;
+				pthread_cond_broadcast(&flowControl->condition);
+				pthread_mutex_unlock(&flowControl->mutex);
+				continue;
+			}
+			source->held = 1;
+			if ( full ) continue;
+		}
+		
+		CMReceivePipelineJob *job = calloc(1, sizeof(CMReceivePipelineJob));
+		if ( job == NULL ) break;
+		job->source = source;
+		job->sequence = source->nextSequence++;
+		job->record = source->record;
+		job->length = source->length;
+		job->error = source->error;
+		job->converterf = CMGetConverterF(source->communicationDescriptor);
+		source->record = NULL;
+		source->held = 0;
+		
+		pthread_mutex_lock(&pipeline->mutex);
+		pipeline->queued++;
+		pipeline->outstanding++;
+		source->backlog++;
+		pthread_mutex_unlock(&pipeline->mutex);
+		
+		/* Spread the records over the workers, idle workers will steal the rest */
+		CMReceivePipelineDeque *deque = &(pipeline->deques[(job->sequence + (unsigned long)source->communicationDescriptor) % pipeline->workerCount]);
+		pthread_mutex_lock(&deque->mutex);
+		job->previous = deque->tail;
+		if ( deque->tail != NULL ) deque->tail->next = job;
+		else deque->head = job;
+		deque->tail = job;
+		pthread_mutex_unlock(&deque->mutex);
+		pthread_cond_signal(&pipeline->workAvailable);
+	}
+	
+	pthread_mutex_lock(&flowControl->mutex);
+	flowControl->reading = 0;
+	pthread_cond_broadcast(&flowControl->condition);
+	pthread_mutex_unlock(&flowControl->mutex);
+	
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->readers--;
+	pthread_cond_broadcast(&pipeline->messageAvailable);
+	pthread_mutex_unlock(&pipeline->mutex);
+	return NULL;
+}
+
+static void *CMReceivePipelineWork(void *arg) {
+	CMReceivePipelineDeque *own = arg;
+	CMReceivePipeline *pipeline = own->pipeline;
+	
+	for (;;) {
+		CMReceivePipelineJob *job = CMReceivePipelineTake(pipeline, own->index);
+		pthread_mutex_lock(&pipeline->mutex);
+		if ( job == NULL ) {
+			while ( pipeline->queued == 0 && pipeline->stopping == 0 )
+				pthread_cond_wait(&pipeline->workAvailable, &pipeline->mutex);
+			int stopping = pipeline->stopping;
+			pthread_mutex_unlock(&pipeline->mutex);
+			if ( stopping ) break;
+			continue;
+		}
+		pipeline->queued--;
+		pthread_mutex_unlock(&pipeline->mutex);
+		
+		if ( job->error == 0 ) { /* Records over the size limit are only reported */
+			job->message = calloc(1, pipeline->messageSize);
+			if ( job->message == NULL ) job->error = ENOMEM;
+			else if ( job->converterf == NULL ) job->error = EINVAL;
+			else if ( (job->error = CMDecodeRecord(job->converterf, job->record, job->length, job->source->flowControl->maximumDecodedSize, job->message)) != 0 )
+				xdr_free(job->converterf, job->message);
+		}
+		free(job->record);
+		job->record = NULL;
+		
+		CMReceivePipelineDeliver(pipeline, job);
+	}
+	return NULL;
+}
+
+static CMReceivePipelineJob *CMReceivePipelineTake(CMReceivePipeline *pipeline, unsigned int index) {
+	/* Take the oldest record of our own deque, otherwise steal the newest of another worker */
+	for (unsigned int i=0; i<pipeline->workerCount; i++) {
+		CMReceivePipelineDeque *deque = &(pipeline->deques[(index + i) % pipeline->workerCount]);
+		pthread_mutex_lock(&deque->mutex);
+		CMReceivePipelineJob *job = (i == 0) ? deque->head : deque->tail;
+		if ( job != NULL ) {
+			if ( job->previous != NULL ) job->previous->next = job->next;
+			else deque->head = job->next;
+			if ( job->next != NULL ) job->next->previous = job->previous;
+			else deque->tail = job->previous;
+			job->next = job->previous = NULL;
+		}
+		pthread_mutex_unlock(&deque->mutex);
+		if ( job != NULL ) return job;
+	}
+	return NULL;
+}
+
+static void CMReceivePipelineDeliver(CMReceivePipeline *pipeline, CMReceivePipelineJob *job) {
+	CMReceivePipelineSource *source = job->source;
+	pthread_mutex_lock(&pipeline->mutex);
+	
+	CMReceivePipelineJob *ready = job;
+	if ( pipeline->ordered ) { /* Park the message until every previous one of the same descriptor is delivered */
+		CMReceivePipelineJob **link = &(source->pending);
+		while ( *link != NULL && (*link)->sequence < job->sequence ) link = &((*link)->next);
+		job->next = *link;
+		*link = job;
+		ready = NULL;
+		if ( source->pending->sequence == source->nextDelivery ) {
+			ready = source->pending;
+			CMReceivePipelineJob *last = ready;
+			for (source->nextDelivery++; last->next != NULL && last->next->sequence == source->nextDelivery; source->nextDelivery++)
+				last = last->next;
+			source->pending = last->next;
+			last->next = NULL;
+		}
+	}
+	
+	for (CMReceivePipelineJob *next; ready != NULL; ready = next) {
+		next = ready->next;
+		ready->next = NULL;
+		if ( pipeline->tail != NULL ) pipeline->tail->next = ready;
+		else pipeline->head = ready;
+		pipeline->tail = ready;
+		pipeline->outstanding--;
+	}
+	pthread_cond_broadcast(&pipeline->messageAvailable);
+	pthread_mutex_unlock(&pipeline->mutex);
+}
+
+static void CMReceivePipelineFreeJobs(CMReceivePipelineJob *job) {
+	/* The records are dropped, their credits are still owed to the peer */
+	for (CMReceivePipelineJob *next; job != NULL; job = next) {
+		next = job->next;
+		CMFlowControlConsumed(job->source->flowControl);
+		if ( job->message != NULL && job->error == 0 ) xdr_free(job->converterf, job->message);
+		free(job->message);
+		free(job->record);
+		free(job);
+	}
+}
+
 void CMSetConverterF(int communicationDescriptor, xdrproc_t converterf) {
 	if ( NULL == converterf ) { errno = EINVAL; return; }
 	if ( CMInternalData.capacity < UINT_MAX && (unsigned int)communicationDescriptor >= CMInternalData.capacity) { errno = EINVAL; return; }
@@ -245,35 +847,206 @@ int CMConvertDigestToHexString(char *restrict dest, const unsigned char *restric
 	return 0;
 }
 
-#if defined(__APPLE__) && defined(__MACH__)
-static int readit(void *handler, void *buffer, int nbytes) {
-#else
-static int readit(char *handler, char *buffer, int nbytes) {
-#endif
-	CMCommunicationDescriptionContext *context = handler;
-	int bytes =
-	(int)read(context->socket, buffer, (size_t)nbytes);
+static int writeall(int socket, const char *buffer, size_t nbytes) {
+	while ( nbytes > 0 ) {
+		ssize_t bytes = write(socket, buffer, nbytes);
+		if ( bytes < 0 && errno == EINTR ) continue;
+		if ( bytes <= 0 ) return -1;
 #if DEBUG
-	int err = errno;
-	if (bytes < 0) perror("readit/read()"), printf("[%s] the errno is %d\n", __FUNCTION__, err);
-	printf("[%s] int:%d\n", __FUNCTION__, bytes);
+		printf("[%s] int:%zd\n", __FUNCTION__, bytes);
 #endif
-	return (bytes==0) ? -1 : bytes;
+		buffer += bytes, nbytes -= (size_t)bytes;
+	}
+	return 0;
 }
 
-#if defined(__APPLE__) && defined(__MACH__)
-	static int writeit(void *handler, void *buffer, int nbytes) {
-#else
-	static int writeit(char *handler, char *buffer, int nbytes) {
-#endif
-	CMCommunicationDescriptionContext *context = handler;
-	int bytes = (int)write(context->socket, buffer, (size_t)nbytes);
+static int readall(int socket, char *buffer, size_t nbytes) {
+	while ( nbytes > 0 ) {
+		int state;
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+		ssize_t bytes = read(socket, buffer, nbytes);
+		pthread_setcancelstate(state, NULL);
+		if ( bytes < 0 && errno == EINTR ) continue;
+		if ( bytes == 0 ) return errno = ECONNRESET, -1; /* The peer closed the connection, callers must not see a stale errno */
+		if ( bytes < 0 ) return -1;
 #if DEBUG
-	printf("[%s] int:%d\n", __FUNCTION__, nbytes);
-	int err = errno;
-	if (bytes < 0) perror("writeit/read()"), printf("[%s] the errno is %d\n", __FUNCTION__, err);
+		printf("[%s] int:%zd\n", __FUNCTION__, bytes);
 #endif
-	return bytes;
+		buffer += bytes, nbytes -= (size_t)bytes;
+	}
+	return 0;
+}
+
+static int readrecord(int socket, size_t maximumRecordSize, char **record, size_t *length) {
+	/* Assemble a whole record, fragment by fragment. The size limit is checked on each record mark, before the record grows,
+	 * and the record only grows as its bytes arrive so that a claimed length alone allocates nothing. On error the record is freed. */
+	size_t size = 0;
+	size_t capacity = 0;
+	bool_t last = (FALSE);
+	while ( last == (FALSE) ) {
+		unsigned char header[4];
+		if ( readall(socket, (char *)header, sizeof(header)) != 0 ) return discardrecord(record);
+		uint32_t mark = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+		last = (mark & 0x80000000U) ? (TRUE) : (FALSE);
+		size_t fragment = (size_t)(mark & 0x7fffffffU);
+		
+		if ( maximumRecordSize != 0 && fragment > maximumRecordSize - size ) { /* Too large: skip the rest of the record to stay in sync */
+			free(*record), *record = NULL;
+			for (;;) {
+				char discard[512];
+				while ( fragment > 0 ) {
+					size_t bytes = (fragment < sizeof(discard)) ? fragment : sizeof(discard);
+					if ( readall(socket, discard, bytes) != 0 ) return -1;
+					fragment -= bytes;
+				}
+				if ( last == (TRUE) ) return errno = EMSGSIZE, -1;
+				if ( readall(socket, (char *)header, sizeof(header)) != 0 ) return -1;
+				mark = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+				last = (mark & 0x80000000U) ? (TRUE) : (FALSE);
+				fragment = (size_t)(mark & 0x7fffffffU);
+			}
+		}
+		
+		while ( fragment > 0 ) {
+			if ( capacity == size ) { /* Double the record, by at least CMRecordGrowthSize, across fragments so that small ones do not cost a realloc each */
+				size_t growth = (size > CMRecordGrowthSize) ? size : CMRecordGrowthSize;
+				if ( last == (TRUE) && growth > fragment ) growth = fragment; /* Nothing follows the last fragment */
+				if ( maximumRecordSize != 0 && growth > maximumRecordSize - capacity ) growth = maximumRecordSize - capacity;
+				char *newRecord = realloc(*record, capacity + growth);
+				if ( newRecord == NULL ) return errno = ENOMEM, discardrecord(record);
+				*record = newRecord;
+				capacity += growth;
+			}
+			size_t bytes = (fragment < capacity - size) ? fragment : capacity - size;
+			if ( readall(socket, *record + size, bytes) != 0 ) return discardrecord(record);
+			size += bytes, fragment -= bytes;
+		}
+	}
+	*length = size;
+	return 0;
+}
+
+static int discardrecord(char **record) {
+	int error = errno;
+	free(*record), *record = NULL;
+	errno = error;
+	return -1;
+}
+
+static int CMFlowControlNextRecord(CMCommunicationFlowControl *flowControl, char **record, size_t *length) {
+	pthread_mutex_lock(&flowControl->mutex);
+	for (;;) {
+		CMCommunicationRecord *stashed = flowControl->head;
+		if ( stashed != NULL ) { /* Read by a sender waiting for credits */
+			flowControl->head = stashed->next;
+			if ( flowControl->head == NULL ) flowControl->tail = NULL;
+			flowControl->stashed--;
+			pthread_mutex_unlock(&flowControl->mutex);
+			int error = stashed->error;
+			*record = stashed->record, *length = stashed->length;
+			free(stashed);
+			return (error == 0) ? 0 : (errno = error, -1);
+		}
+		if ( flowControl->reading == 0 ) break;
+		pthread_cond_wait(&flowControl->condition, &flowControl->mutex);
+	}
+	flowControl->reading = 1;
+	pthread_mutex_unlock(&flowControl->mutex);
+	
+	int retval;
+	for (;;) {
+		retval = readrecord(flowControl->socket, flowControl->maximumRecordSize, record, length);
+		if ( retval != 0 || *length != 0 || flowControl->window == 0 ) break;
+		free(*record), *record = NULL; /* A credit returned by the peer */
+		pthread_mutex_lock(&flowControl->mutex);
+		flowControl->credits++;
+		pthread_cond_broadcast(&flowControl->condition);
+		pthread_mutex_unlock(&flowControl->mutex);
+	}
+	
+	int error = errno;
+	pthread_mutex_lock(&flowControl->mutex);
+	flowControl->reading = 0;
+	pthread_cond_broadcast(&flowControl->condition);
+	pthread_mutex_unlock(&flowControl->mutex);
+	return (retval == 0) ? 0 : (errno = error, -1);
+}
+
+static int CMFlowControlAcquireCredit(CMCommunicationFlowControl *flowControl) {
+	pthread_mutex_lock(&flowControl->mutex);
+	if ( flowControl->window == 0 ) return pthread_mutex_unlock(&flowControl->mutex), 0;
+	
+	while ( flowControl->credits == 0 ) {
+		if ( flowControl->reading ) { /* Whoever reads the socket will hand us the credits */
+			pthread_cond_wait(&flowControl->condition, &flowControl->mutex);
+			continue;
+		}
+		
+		/* Read the socket ourselves, keeping the messages for the receiver. The peer can not send more than our window of them. */
+		flowControl->reading = 1;
+		pthread_mutex_unlock(&flowControl->mutex);
+		char *record = NULL;
+		size_t length = 0;
+		int result = readrecord(flowControl->socket, flowControl->maximumRecordSize, &record, &length);
+		int error = (result == 0) ? 0 : errno;
+		CMCommunicationRecord *stashed = NULL;
+		if ( result == 0 && length == 0 ) free(record);
+		else if ( (result == 0 || error == EMSGSIZE) && (stashed = calloc(1, sizeof(CMCommunicationRecord))) == NULL )
+			free(record), record = NULL, result = -1, error = ENOMEM;
+		
+		pthread_mutex_lock(&flowControl->mutex);
+		flowControl->reading = 0;
+		pthread_cond_broadcast(&flowControl->condition);
+		if ( result == 0 && length == 0 ) flowControl->credits++;
+		else if ( stashed != NULL && flowControl->stashed >= flowControl->window ) /* A peer ignoring the window */
+			return pthread_mutex_unlock(&flowControl->mutex), free(stashed), free(record), errno = EPROTO, -1;
+		else if ( stashed != NULL ) {
+			stashed->record = record, stashed->length = length, stashed->error = error;
+			if ( flowControl->tail != NULL ) flowControl->tail->next = stashed;
+			else flowControl->head = stashed;
+			flowControl->tail = stashed;
+			flowControl->stashed++;
+		}
+		else return pthread_mutex_unlock(&flowControl->mutex), free(record), errno = error, -1;
+	}
+	flowControl->credits--;
+	pthread_mutex_unlock(&flowControl->mutex);
+	return 0;
+}
+
+static void CMFlowControlConsumed(CMCommunicationFlowControl *flowControl) {
+	/* Credits are returned in batches of half the window, each as an empty record */
+	pthread_mutex_lock(&flowControl->mutex);
+	if ( flowControl->window > 0 && ++flowControl->consumed >= (flowControl->window + 1) / 2 )
+		flowControl->owed += flowControl->consumed, flowControl->consumed = 0;
+	pthread_mutex_unlock(&flowControl->mutex);
+	CMFlowControlReturnCredits(flowControl);
+}
+
+static void CMFlowControlReturnCredits(CMCommunicationFlowControl *flowControl) {
+	/* Never wait for a send in progress: the peer may itself be blocked sending to us, its credits would then never come.
+	 * The sender holding writeMutex calls us again once done, so credits owed meanwhile are written after its record. */
+	int error = errno;
+	for (;;) {
+		pthread_mutex_lock(&flowControl->mutex);
+		unsigned int owed = flowControl->owed;
+		pthread_mutex_unlock(&flowControl->mutex);
+		if ( owed == 0 || pthread_mutex_trylock(&flowControl->writeMutex) != 0 ) break;
+		
+		pthread_mutex_lock(&flowControl->mutex);
+		unsigned int credits = flowControl->owed;
+		flowControl->owed = 0;
+		pthread_mutex_unlock(&flowControl->mutex);
+		static const char marks[4 * 4] = { [0] = (char)0x80, [4] = (char)0x80, [8] = (char)0x80, [12] = (char)0x80 };
+		int retval = 0;
+		for (unsigned int count; credits > 0 && retval == 0; credits -= count) {
+			count = (credits < 4) ? credits : 4;
+			retval = writeall(flowControl->socket, marks, count * 4);
+		}
+		pthread_mutex_unlock(&flowControl->writeMutex);
+		if ( retval != 0 ) break;
+	}
+	errno = error;
 }
 
 //bool_t xdr_digest(XDR *xdrs, CMCommunicationDescriptionContext *context) {
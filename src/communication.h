@@ -16,6 +16,7 @@
 
 #include <openssl/sha.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <rpc/types.h>
 #include <rpc/xdr.h>
 
@@ -103,7 +104,7 @@ xdrproc_t CMGetConverterF(int communicationDescriptor);
  *  @fn int CMSendMessage(int communicationDescriptor, void *message)
  *  @brief Send a @a message.
  *  @ingroup communication
- *  @details Sends the specified @a message to the socket associated to the communcation descriptor, obtained from a successful call to @ref CMInitCommunicationWithSocketAndConverter. If the call fails then nothing is written in the socket associated to this communication descriptor. This function uses the converter method specified via @ref CMInitCommunicationWithSocketAndConverter or @ref CMSetConverterF.
+ *  @details Sends the specified @a message to the socket associated to the communcation descriptor, obtained from a successful call to @ref CMInitCommunicationWithSocketAndConverter. If the call fails then nothing is written in the socket associated to this communication descriptor. This function uses the converter method specified via @ref CMInitCommunicationWithSocketAndConverter or @ref CMSetConverterF. The converter is run twice: once to compute the encoded size and once to encode the message, which is then sent as a single record fragment. Use @ref CMSendMessageWithSizeHint to skip the first pass.
  *  @warning Calling this function concurrently from multiple threads with the same communication descriptor results in **undefined behaviour**.
  *
  *  ~~~~~~~~~~~~~~~~~~~~{.c}
@@ -119,6 +120,9 @@ xdrproc_t CMGetConverterF(int communicationDescriptor);
  *  @par Possible errors:
  *		- **EINVAL** The communication descriptor is invalid.
  *		- **EINVAL** The message is @a NULL or a field of the message is not valid.
+ *		- **ENOMEM** Insufficient memory is available for the encoding buffer.
+ *		- **EPROTO** While waiting for credits, the peer sent more messages than the flow control window allows.
+ *		- **ECONNRESET** While waiting for credits, the peer closed the connection.
  *
  *  @param[in] communicationDescriptor the communication descriptor.
  *  @param[in] message the message to be send.
@@ -126,6 +130,34 @@ xdrproc_t CMGetConverterF(int communicationDescriptor);
  */
 int CMSendMessage(int communicationDescriptor, void *message);
 
+/*!
+ *  @fn int CMSendMessageWithSizeHint(int communicationDescriptor, void *message, size_t sizeHint)
+ *  @brief Send a @a message whose encoded size is known in advance.
+ *  @ingroup communication
+ *  @details Behaves like @ref CMSendMessage. The message is encoded into a buffer of @a sizeHint bytes and sent as a single record fragment with one write. When @a sizeHint is 0 the encoded size is computed by running the converter in a size-counting pass (see `xdr_sizeof()`); @ref CMSendMessage does exactly that. If @a sizeHint turns out to be too small the counting pass is used instead, so a hint only saves work and never changes what is sent. The encoding buffer is kept for the next message unless it is larger than 64 KiB.
+ *  @warning Calling this function concurrently from multiple threads with the same communication descriptor results in **undefined behaviour**.
+ *
+ *  ~~~~~~~~~~~~~~~~~~~~{.c}
+ *		int communicationDescriptor = CMInitCommunicationWithSocket(socket, converter);
+ *		CMSendMessageWithSizeHint(communicationDescriptor, message, 4 + 4 + 4 + length);
+ *  ~~~~~~~~~~~~~~~~~~~~
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** The communication descriptor is invalid.
+ *		- **EINVAL** The message is @a NULL or a field of the message is not valid.
+ *		- **EINVAL** The encoded message does not fit in a single record fragment (2^31-1 bytes).
+ *		- **EINVAL** The encoded message is empty and flow control is enabled (see @ref CMSetFlowControlWindow).
+ *		- **ENOMEM** Insufficient memory is available for the encoding buffer.
+ *		- **EPROTO** While waiting for credits, the peer sent more messages than the flow control window allows.
+ *		- **ECONNRESET** While waiting for credits, the peer closed the connection.
+ *
+ *  @param[in] communicationDescriptor the communication descriptor.
+ *  @param[in] message the message to be send.
+ *  @param[in] sizeHint the encoded size of the message in bytes, or 0 if unknown.
+ *  @returns 0 on success. On error, -1 is returned, and @a errno is set appropriately.
+ */
+int CMSendMessageWithSizeHint(int communicationDescriptor, void *message, size_t sizeHint);
+
 /*!
  *  @fn int CMReceiveMessage(int communicationDescriptor, void *message)
  *  @brief Receives a @a message.
@@ -148,6 +180,9 @@ int CMSendMessage(int communicationDescriptor, void *message);
  *  @par Possible errors:
  *		- **EINVAL** The communication descriptor is invalid.
  *		- **EINVAL** The message is @a NULL.
+ *		- **EINVAL** The record received could not be decoded.
+ *		- **EMSGSIZE** The record received is larger than the limit set by @ref CMSetReceiveLimits. It was skipped without being stored.
+ *		- **ECONNRESET** The peer closed the connection.
  *
  *  @param[in] communicationDescriptor the communcation descriptor.
  *  @param[in,out] message the message to be filled with the received data.
@@ -167,6 +202,176 @@ int CMReceiveMessage(int communicationDescriptor, void *message);
  */
 void CMDestroyMessage(void *message, xdrproc_t converter);
 
+/*!
+ *  @fn int CMSetReceiveLimits(int communicationDescriptor, size_t maximumRecordSize, size_t maximumDecodedSize)
+ *  @brief Bounds the memory a peer can make us allocate.
+ *  @ingroup communication
+ *  @details Records are read whole before being decoded. A record longer than @a maximumRecordSize bytes is detected on its record marks, before it is stored, and is skipped: the receiving function fails with **EMSGSIZE** and the next record can still be received. Records only grow as their bytes arrive, so a forged record mark costs no more than the bytes actually sent. @a maximumDecodedSize bounds each variable length item decoded by a converter using @ref CMDecodeLimit or @ref CMDecodeArrayLimit; it is not a budget for the whole message. A limit of 0, the default, means no limit.
+ *
+ *  @par Thread-safety:
+ *  Calling this function from multiple threads will **always** terminate correctly (unless another error occurs, as described in errors section).
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** The communication descriptor is invalid.
+ *
+ *  @param[in] communicationDescriptor the communication descriptor.
+ *  @param[in] maximumRecordSize the maximum size of a received record in bytes, or 0.
+ *  @param[in] maximumDecodedSize the maximum size in bytes of each variable length item decoded by a converter using @ref CMDecodeLimit or @ref CMDecodeArrayLimit, or 0.
+ *  @returns 0 on success. On error, -1 is returned, and @a errno is set appropriately.
+ */
+int CMSetReceiveLimits(int communicationDescriptor, size_t maximumRecordSize, size_t maximumDecodedSize);
+
+/*!
+ *  @fn u_int CMDecodeLimit(XDR *xdrs)
+ *  @brief Maximum size of the next variable length item to decode.
+ *  @ingroup communication
+ *  @details XDR allocates strings and opaque data as soon as their length is decoded, before checking that the record holds them. Converters should pass this value as the maximum size to `xdr_string()` or `xdr_bytes()` so that a forged length fails the decoding instead of being allocated. When decoding a received record it is the number of bytes left in the record, bounded by the limit set with @ref CMSetReceiveLimits. The limit applies to each item on its own. For any other stream, such as one created by the caller, it is `UINT_MAX`. The maximum size of `xdr_array()` counts elements, use @ref CMDecodeArrayLimit for it.
+ *
+ *  ~~~~~~~~~~~~~~~~~~~~{.c}
+ *		bool_t xdr_message(XDR *xdrs, struct message *message) {
+ *			return xdr_string(xdrs, &(message->string), CMDecodeLimit(xdrs));
+ *		}
+ *  ~~~~~~~~~~~~~~~~~~~~
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** @a xdrs is @a NULL.
+ *
+ *  @param[in] xdrs the XDR stream passed to the converter.
+ *  @returns the maximum size of the next variable length item, or 0 on error.
+ */
+u_int CMDecodeLimit(XDR *xdrs);
+
+/*!
+ *  @fn u_int CMDecodeArrayLimit(XDR *xdrs, size_t elementSize, size_t elementWireSize)
+ *  @brief Maximum number of elements of the next array to decode.
+ *  @ingroup communication
+ *  @details The element counting variant of @ref CMDecodeLimit, to pass as the maximum size to `xdr_array()`. When decoding a received record it is the number of elements of at least @a elementWireSize encoded bytes the rest of the record can hold, bounded so that the decoded array, of @a elementSize bytes per element, stays within the limit set with @ref CMSetReceiveLimits. An @a elementWireSize below 4, the size of an XDR unit, counts as 4. For any other stream it is `UINT_MAX`.
+ *
+ *  ~~~~~~~~~~~~~~~~~~~~{.c}
+ *		bool_t xdr_message(XDR *xdrs, struct message *message) {
+ *			return xdr_array(xdrs, (char **)&(message->values), &(message->count), CMDecodeArrayLimit(xdrs, sizeof(int), 4), sizeof(int), (xdrproc_t)xdr_int);
+ *		}
+ *  ~~~~~~~~~~~~~~~~~~~~
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** @a xdrs is @a NULL or @a elementSize is 0.
+ *
+ *  @param[in] xdrs the XDR stream passed to the converter.
+ *  @param[in] elementSize the size in bytes of a decoded element, as passed to `xdr_array()`.
+ *  @param[in] elementWireSize the minimum size in bytes of an encoded element.
+ *  @returns the maximum number of elements of the next array, or 0 on error.
+ */
+u_int CMDecodeArrayLimit(XDR *xdrs, size_t elementSize, size_t elementWireSize);
+
+/*!
+ *  @fn int CMSetFlowControlWindow(int communicationDescriptor, unsigned int window)
+ *  @brief Enables credit-based flow control.
+ *  @ingroup communication
+ *  @details With a non-zero @a window, at most @a window messages can be sent before the peer has received some of them. The peer returns a credit for each message it receives, in batches of half the window, as an empty record. While waiting for credits @ref CMSendMessage reads the socket and keeps the messages received for @ref CMReceiveMessage. At most @a window of them are kept: a peer sending more is ignoring the window and the send fails with **EPROTO**. A @a window of 0, the default, disables flow control.
+ *  @warning Both ends must enable flow control with the same window before sending their first message. Empty messages, such as the encoding of `xdr_void()`, can not be sent while it is enabled: the peer would take them for credits.
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** The communication descriptor is invalid.
+ *
+ *  @param[in] communicationDescriptor the communication descriptor.
+ *  @param[in] window the number of messages that can be in flight, or 0.
+ *  @returns 0 on success. On error, -1 is returned, and @a errno is set appropriately.
+ */
+int CMSetFlowControlWindow(int communicationDescriptor, unsigned int window);
+
+/*!
+ *  @typedef CMReceivePipeline
+ *  @brief Opaque type of a pipelined receiver.
+ *  @ingroup communication
+ *  @details A pipelined receiver reads whole records from one or more communication descriptors, each with its own reader thread, and decodes them in parallel on a pool of worker threads. Idle workers steal records queued for busy ones. Decoded messages are delivered through @ref CMReceivePipelineNextMessage.
+ */
+typedef struct _receivePipeline CMReceivePipeline;
+
+/*!
+ *  @fn CMReceivePipeline *CMCreateReceivePipeline(unsigned int workers, unsigned int backlog, size_t messageSize, int ordered)
+ *  @brief Creates a pipelined receiver.
+ *  @ingroup communication
+ *  @details Starts @a workers decoding threads. Each record is decoded, with the converter of the communication descriptor it was read from, into a new zeroed message of @a messageSize bytes. If @a ordered is non-zero the messages of a given communication descriptor are delivered in the order they were received, otherwise they are delivered as soon as they are decoded. At most @a backlog records of a communication descriptor are held by the pipeline, from the moment they are read until they are delivered by @ref CMReceivePipelineNextMessage; past that its reader stops reading the socket until the consumer catches up. With flow control (see @ref CMSetFlowControlWindow) the reader keeps reading the credits the peer returns for our own messages, so that @ref CMSendMessage can go on; for this the window of a communication descriptor must not be larger than @a backlog.
+ *
+ *  ~~~~~~~~~~~~~~~~~~~~{.c}
+ *		CMReceivePipeline *pipeline = CMCreateReceivePipeline(4, 64, sizeof(struct message), 1);
+ *		CMReceivePipelineAddCommunicationDescriptor(pipeline, communicationDescriptor);
+ *		struct message message;
+ *		int from;
+ *		while (CMReceivePipelineNextMessage(pipeline, &from, &message) == 0) {
+ *			// message is valid
+ *			CMDestroyMessage(&message, CMGetConverterF(from));
+ *		}
+ *		CMDestroyReceivePipeline(pipeline);
+ *  ~~~~~~~~~~~~~~~~~~~~
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** @a workers, @a backlog or @a messageSize is 0.
+ *		- **ENOMEM** Insufficient memory is available for internal structures.
+ *		- **EAGAIN** The worker threads could not be created.
+ *
+ *  @param[in] workers the number of decoding threads.
+ *  @param[in] backlog the maximum number of undelivered records of each communication descriptor.
+ *  @param[in] messageSize the size of the structure filled by the converters.
+ *  @param[in] ordered whether the messages of each communication descriptor keep their order.
+ *  @returns on success a new pipelined receiver, that should be destroyed by @ref CMDestroyReceivePipeline. On error, @a NULL is returned, and @a errno is set appropriately.
+ */
+CMReceivePipeline *CMCreateReceivePipeline(unsigned int workers, unsigned int backlog, size_t messageSize, int ordered);
+
+/*!
+ *  @fn void CMDestroyReceivePipeline(CMReceivePipeline *pipeline)
+ *  @brief Destroys a pipelined receiver.
+ *  @ingroup communication
+ *  @details Stops the reader and worker threads and releases the messages not yet delivered, returning their credits to the peer when flow control is enabled. The communication descriptors are not terminated, but their readers may be stopped in the middle of a record, leaving their sockets out of sync: they can no longer be used and should only be terminated with @ref CMFinishCommunicationWithCommunicationDescriptor.
+ *  @warning Calling this function while another thread is using the pipeline results in **undefined behaviour**.
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** The pipeline is @a NULL.
+ *
+ *  @param[in] pipeline the pipelined receiver.
+ */
+void CMDestroyReceivePipeline(CMReceivePipeline *pipeline);
+
+/*!
+ *  @fn int CMReceivePipelineAddCommunicationDescriptor(CMReceivePipeline *pipeline, int communicationDescriptor)
+ *  @brief Attaches a communication descriptor to a pipelined receiver.
+ *  @ingroup communication
+ *  @details Starts a reader thread pulling records off the socket of the communication descriptor. The limits set by @ref CMSetReceiveLimits apply and, with flow control, credits are returned as the messages are delivered by @ref CMReceivePipelineNextMessage. The flow control window must be set before and must not be changed while attached.
+ *  @warning Once attached, calling @ref CMReceiveMessage with the communication descriptor results in **undefined behaviour**. @ref CMSendMessage can still be used.
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** The pipeline is @a NULL or is being destroyed.
+ *		- **EINVAL** The communication descriptor is invalid.
+ *		- **EINVAL** The flow control window of the communication descriptor is larger than the backlog of the pipeline.
+ *		- **ENOMEM** Insufficient memory is available for internal structures.
+ *		- **EAGAIN** The reader thread could not be created.
+ *
+ *  @param[in] pipeline the pipelined receiver.
+ *  @param[in] communicationDescriptor the communication descriptor.
+ *  @returns 0 on success. On error, -1 is returned, and @a errno is set appropriately.
+ */
+int CMReceivePipelineAddCommunicationDescriptor(CMReceivePipeline *pipeline, int communicationDescriptor);
+
+/*!
+ *  @fn int CMReceivePipelineNextMessage(CMReceivePipeline *pipeline, int *communicationDescriptor, void *message)
+ *  @brief Receives the next decoded @a message.
+ *  @ingroup communication
+ *  @details Blocks until a message is decoded, then fills the @a message passed as argument with it. Its data should be desallocated with @ref CMDestroyMessage. Can be called from multiple threads.
+ *
+ *  @par Possible errors:
+ *		- **EINVAL** The pipeline or the message is @a NULL.
+ *		- **EINVAL** The record received could not be decoded. @a communicationDescriptor is still filled.
+ *		- **ENOMEM** Insufficient memory was available to decode the record. @a communicationDescriptor is still filled.
+ *		- **EMSGSIZE** The record received is larger than the limit set by @ref CMSetReceiveLimits. @a communicationDescriptor is still filled.
+ *		- **EPIPE** Every attached communication descriptor reached its end and all their messages were delivered.
+ *
+ *  @param[in] pipeline the pipelined receiver.
+ *  @param[out] communicationDescriptor filled with the communication descriptor the message was received from. Can be @a NULL.
+ *  @param[in,out] message the message to be filled with the received data.
+ *  @returns 0 on success. On error, -1 is returned, and @a errno is set appropriately.
+ */
+int CMReceivePipelineNextMessage(CMReceivePipeline *pipeline, int *communicationDescriptor, void *message);
+
 /*!
  *  @fn int CMConvertDigestToHexString(char *restrict dest, unsigned char *restrict src)
  *  @brief Convenience function for tranforming a SHA1 digest to a hex string.
@@ -0,0 +1,187 @@
+//
+//  benchReceivePipeline.c
+//  communication
+//
+//  Created by averello on 18/10/26.
+//  Copyright (c) 2013 George Boumis. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <communication.h>
+
+#define BENCHDescriptors 4
+#define BENCHMessages 2000
+#define BENCHBranches 32
+#define BENCHLeaves 32
+#define BENCHBacklog 64
+
+typedef struct _leaf {
+	int values[4];
+	double weight;
+} CMLeaf;
+
+typedef struct _branch {
+	u_int count;
+	CMLeaf *leaves;
+} CMBranch;
+
+typedef struct _message {
+	int sequence;
+	u_int count;
+	CMBranch *branches;
+} CMMessage;
+
+typedef struct _sender {
+	int socket;
+	const char *record;
+	size_t length;
+} CMSender;
+
+bool_t xdr_leaf(XDR *xdrs, CMLeaf *leaf);
+bool_t xdr_branch(XDR *xdrs, CMBranch *branch);
+bool_t xdr_message(XDR *xdrs, const void *message);
+static void *sendRecords(void *arg);
+static double now(void);
+static double run(int descriptors[BENCHDescriptors], CMSender senders[BENCHDescriptors], unsigned int workers, int ordered);
+
+int main (int argc, char ** argv) {
+	/* A deeply nested message, encoded once as a single fragment record */
+	CMLeaf leaves[BENCHLeaves];
+	CMBranch branches[BENCHBranches];
+	for (int i=0; i<BENCHLeaves; i++) leaves[i] = (CMLeaf){ { i, i+1, i+2, i+3 }, i/3.0 };
+	for (int i=0; i<BENCHBranches; i++) branches[i] = (CMBranch){ BENCHLeaves, leaves };
+	CMMessage message = { 0, BENCHBranches, branches };
+
+	size_t length = (size_t)xdr_sizeof((xdrproc_t)xdr_message, &message);
+	char *record = malloc(4 + length);
+	if ( record == NULL ) fprintf(stderr, "can't allocate record\n"), exit(EXIT_FAILURE);
+	XDR xdrs;
+	xdrmem_create(&xdrs, record + 4, (u_int)length, XDR_ENCODE);
+	if ( xdr_message(&xdrs, &message) != (TRUE) ) fprintf(stderr, "can't encode record\n"), exit(EXIT_FAILURE);
+	xdr_destroy(&xdrs);
+	uint32_t mark = 0x80000000U | (uint32_t)length;
+	record[0] = (char)(mark >> 24), record[1] = (char)(mark >> 16), record[2] = (char)(mark >> 8), record[3] = (char)mark;
+
+	int sockets[BENCHDescriptors][2];
+	int descriptors[BENCHDescriptors];
+	CMSender senders[BENCHDescriptors];
+	for (int i=0; i<BENCHDescriptors; i++) {
+		if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[i]) != 0 )
+			perror("socketpair"), exit(EXIT_FAILURE);
+		descriptors[i] = CMInitCommunicationWithSocketAndConverter(sockets[i][1], (xdrproc_t)xdr_message);
+		if ( descriptors[i] == -1 )
+			perror("CMInitCommunicationWithSocketAndConverter"), exit(EXIT_FAILURE);
+		senders[i] = (CMSender){ sockets[i][0], record, 4 + length };
+	}
+
+	printf("%d descriptors, %d messages each, %zu bytes per message\n", BENCHDescriptors, BENCHMessages, length);
+	printf("%-24s %14s\n", "receiver", "messages/s");
+	printf("%-24s %14.0f\n", "CMReceiveMessage", run(descriptors, senders, 0, 0));
+	for (unsigned int workers = 1; workers <= 8; workers <<= 1) {
+		char label[32];
+		sprintf(label, "pipeline %u ordered", workers);
+		printf("%-24s %14.0f\n", label, run(descriptors, senders, workers, 1));
+		sprintf(label, "pipeline %u unordered", workers);
+		printf("%-24s %14.0f\n", label, run(descriptors, senders, workers, 0));
+	}
+
+	for (int i=0; i<BENCHDescriptors; i++) {
+		CMFinishCommunicationWithCommunicationDescriptor(descriptors[i]);
+		close(sockets[i][0]), close(sockets[i][1]);
+	}
+	free(record);
+
+	return EXIT_SUCCESS;
+}
+
+static double run(int descriptors[BENCHDescriptors], CMSender senders[BENCHDescriptors], unsigned int workers, int ordered) {
+	CMReceivePipeline *pipeline = NULL;
+	if ( workers > 0 ) {
+		pipeline = CMCreateReceivePipeline(workers, BENCHBacklog, sizeof(CMMessage), ordered);
+		if ( pipeline == NULL ) perror("CMCreateReceivePipeline"), exit(EXIT_FAILURE);
+		for (int i=0; i<BENCHDescriptors; i++)
+			if ( CMReceivePipelineAddCommunicationDescriptor(pipeline, descriptors[i]) != 0 )
+				perror("CMReceivePipelineAddCommunicationDescriptor"), exit(EXIT_FAILURE);
+	}
+
+	pthread_t threads[BENCHDescriptors];
+	double start = now();
+	for (int i=0; i<BENCHDescriptors; i++)
+		if ( pthread_create(&threads[i], NULL, sendRecords, &senders[i]) != 0 )
+			fprintf(stderr, "can't create sender\n"), exit(EXIT_FAILURE);
+
+	int expected[BENCHDescriptors] = { 0 };
+	for (int n=0; n<BENCHDescriptors*BENCHMessages; n++) {
+		CMMessage message;
+		int from = descriptors[n % BENCHDescriptors], index;
+		memset(&message, 0, sizeof(message));
+		int result = (pipeline != NULL) ? CMReceivePipelineNextMessage(pipeline, &from, &message) : CMReceiveMessage(from, &message);
+		if ( result != 0 ) perror("receive"), exit(EXIT_FAILURE);
+		for (index=0; index<BENCHDescriptors && descriptors[index] != from; index++);
+		if ( index >= BENCHDescriptors || message.count != BENCHBranches || message.branches[BENCHBranches-1].leaves[BENCHLeaves-1].values[3] != BENCHLeaves+2 )
+			fprintf(stderr, "corrupted message\n"), exit(EXIT_FAILURE);
+		if ( (pipeline == NULL || ordered) && message.sequence != expected[index] )
+			fprintf(stderr, "message %d received instead of %d\n", message.sequence, expected[index]), exit(EXIT_FAILURE);
+		expected[index]++;
+		CMDestroyMessage(&message, (xdrproc_t)xdr_message);
+	}
+	double elapsed = now() - start;
+
+	for (int i=0; i<BENCHDescriptors; i++)
+		pthread_join(threads[i], NULL);
+	if ( pipeline != NULL ) CMDestroyReceivePipeline(pipeline);
+
+	return (double)(BENCHDescriptors*BENCHMessages) / elapsed;
+}
+
+static void *sendRecords(void *arg) {
+	CMSender *sender = arg;
+	char *record = malloc(sender->length);
+	if ( record == NULL ) fprintf(stderr, "can't allocate record\n"), exit(EXIT_FAILURE);
+	memcpy(record, sender->record, sender->length);
+	for (int sequence=0; sequence<BENCHMessages; sequence++) {
+		/* The sequence is the first field, right after the record mark */
+		record[4] = (char)(sequence >> 24), record[5] = (char)(sequence >> 16), record[6] = (char)(sequence >> 8), record[7] = (char)sequence;
+		for (size_t written = 0; written < sender->length; ) {
+			ssize_t bytes = write(sender->socket, record + written, sender->length - written);
+			if ( bytes <= 0 ) perror("write"), exit(EXIT_FAILURE);
+			written += (size_t)bytes;
+		}
+	}
+	free(record);
+	return NULL;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+bool_t xdr_leaf(XDR *xdrs, CMLeaf *leaf) {
+	return (
+			xdr_vector(xdrs, (char *)leaf->values, 4, sizeof(int), (xdrproc_t)xdr_int)
+			&&
+			xdr_double(xdrs, &(leaf->weight))
+			);
+}
+
+bool_t xdr_branch(XDR *xdrs, CMBranch *branch) {
+	return xdr_array(xdrs, (char **)&(branch->leaves), &(branch->count), BENCHLeaves, sizeof(CMLeaf), (xdrproc_t)xdr_leaf);
+}
+
+bool_t xdr_message(XDR *xdrs, const void *mesg) {
+	CMMessage *message = (CMMessage *)mesg;
+	return (
+			xdr_int(xdrs, &(message->sequence))
+			&&
+			xdr_array(xdrs, (char **)&(message->branches), &(message->count), BENCHBranches, sizeof(CMBranch), (xdrproc_t)xdr_branch)
+			);
+}
@@ -0,0 +1,139 @@
+//
+//  benchSendMessage.c
+//  communication
+//
+//  Created by averello on 18/10/26.
+//  Copyright (c) 2013 George Boumis. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <communication.h>
+
+#define BENCHMinSize (64UL)
+#define BENCHMaxSize (16UL<<20)
+#define BENCHBytesPerRun (256UL<<20)
+
+typedef struct _message {
+	u_int length;
+	char *bytes;
+} CMMessage;
+
+typedef struct _receiver {
+	int descriptor;
+	unsigned long count;
+} CMReceiver;
+
+static unsigned long writes = 0;
+
+bool_t xdr_message(XDR *xdrs, const void *message);
+static int writeit(char *handler, char *buffer, int nbytes);
+static int readit(char *handler, char *buffer, int nbytes);
+static void *receive(void *arg);
+static double now(void);
+
+int main (int argc, char ** argv) {
+	int sockets[2];
+	if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0 )
+		perror("socketpair"), exit(EXIT_FAILURE);
+
+	int descClient = CMInitCommunicationWithSocketAndConverter(sockets[0], (xdrproc_t)xdr_message);
+	int descServer = CMInitCommunicationWithSocketAndConverter(sockets[1], (xdrproc_t)xdr_message);
+	if ( descClient == -1 || descServer == -1 )
+		perror("CMInitCommunicationWithSocketAndConverter"), exit(EXIT_FAILURE);
+
+	/* Baseline: the previous implementation, encoding straight into an xdrrec stream */
+	XDR xdrrec;
+	xdrrec_create(&xdrrec, 0, 0, (void *)&sockets[0], readit, writeit);
+	xdrrec.x_op = XDR_ENCODE;
+
+	char *payload = malloc(BENCHMaxSize);
+	if ( payload == NULL ) fprintf(stderr, "can't allocate payload\n"), exit(EXIT_FAILURE);
+	memset(payload, 'x', BENCHMaxSize);
+
+	printf("%10s %8s %14s %10s %14s %14s\n", "size", "count", "xdrrec MB/s", "writes", "sizeof MB/s", "hint MB/s");
+	for (unsigned long size = BENCHMinSize; size <= BENCHMaxSize; size <<= 2) {
+		CMMessage message = { (u_int)size, payload };
+		unsigned long count = BENCHBytesPerRun / size;
+		if ( count > 20000 ) count = 20000;
+		if ( count < 8 ) count = 8;
+		size_t hint = 4 + ((size + 3) & ~3UL);
+		double rates[3];
+		unsigned long writesPerMessage = 0;
+
+		for (int mode = 0; mode < 3; mode++) {
+			CMReceiver receiver = { descServer, count };
+			pthread_t thread;
+			if ( pthread_create(&thread, NULL, receive, &receiver) != 0 )
+				fprintf(stderr, "can't create receiver\n"), exit(EXIT_FAILURE);
+
+			writes = 0;
+			double start = now();
+			for (unsigned long i = 0; i < count; i++) {
+				int result = 0;
+				switch (mode) {
+					case 0:
+						result = ( xdr_message(&xdrrec, &message) && xdrrec_endofrecord(&xdrrec, (TRUE)) ) ? 0 : -1;
+						break;
+					case 1:
+						result = CMSendMessage(descClient, &message);
+						break;
+					case 2:
+						result = CMSendMessageWithSizeHint(descClient, &message, hint);
+						break;
+				}
+				if ( result != 0 ) fprintf(stderr, "send failed\n"), exit(EXIT_FAILURE);
+			}
+			pthread_join(thread, NULL);
+			double elapsed = now() - start;
+			rates[mode] = ((double)size * (double)count) / elapsed / (1024.0 * 1024.0);
+			if ( mode == 0 ) writesPerMessage = (writes + count - 1) / count;
+		}
+		printf("%10lu %8lu %14.1f %10lu %14.1f %14.1f\n", size, count, rates[0], writesPerMessage, rates[1], rates[2]);
+	}
+
+	free(payload);
+	xdr_destroy(&xdrrec);
+	CMFinishCommunicationWithCommunicationDescriptor(descClient);
+	CMFinishCommunicationWithCommunicationDescriptor(descServer);
+	close(sockets[0]), close(sockets[1]);
+
+	return EXIT_SUCCESS;
+}
+
+static void *receive(void *arg) {
+	CMReceiver *receiver = arg;
+	for (unsigned long i = 0; i < receiver->count; i++) {
+		CMMessage message = { 0, NULL };
+		if ( CMReceiveMessage(receiver->descriptor, &message) != 0 )
+			fprintf(stderr, "receive failed\n"), exit(EXIT_FAILURE);
+		CMDestroyMessage(&message, (xdrproc_t)xdr_message);
+	}
+	return NULL;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int writeit(char *handler, char *buffer, int nbytes) {
+	writes++;
+	return (int)write(*(int *)handler, buffer, (size_t)nbytes);
+}
+
+static int readit(char *handler, char *buffer, int nbytes) {
+	return -1;
+}
+
+bool_t xdr_message(XDR *xdrs, const void *mesg) {
+	CMMessage *message = (CMMessage *)mesg;
+	return xdr_bytes(xdrs, &(message->bytes), &(message->length), BENCHMaxSize);
+}
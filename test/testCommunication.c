@@ -24,15 +24,27 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
 
 typedef struct _message {
 	int type;
 	char *string;
 } CMMessage;
 
+typedef struct _blob {
+	u_int count;
+	int *values;
+	u_int length;
+	char *bytes;
+} CMBlob;
+
 int InitConnexion(const char *hostname, int port);
+void WriteRecord(int socket, const void *body, size_t length);
 
 bool_t xdr_message(XDR *xdrs, const void *message);
+bool_t xdr_blob(XDR *xdrs, const void *blob);
 
 int main (int argc, char ** argv) {
 	char idString[SHA_DIGEST_LENGTH*2+1];
@@ -128,6 +140,226 @@ int main (int argc, char ** argv) {
 	printf("message:%p, type:%d, string:\"%s\" hex:\"%s\"\n", (void *)message, message->type, message->string, idString);
 	
 	CMDestroyMessage(message, (xdrproc_t)xdr_message);
+
+	/* A record over the limit is skipped, the next one is still received */
+	message->type = 2;
+	message->string = (char *)string;
+	assert(CMSetReceiveLimits(descServer, 16, 0) == 0);
+	assert(CMSendMessage(descClient, message) == 0);
+	assert(CMReceiveMessage(descServer, message) == -1 && errno == EMSGSIZE);
+	assert(CMSetReceiveLimits(descServer, 0, 0) == 0);
+	message->string = (char *)string;
+	assert(CMSendMessage(descClient, message) == 0);
+	message->string = NULL;
+	assert(CMReceiveMessage(descServer, message) == 0 && message->type == 2 && strcmp(message->string, string) == 0);
+	CMDestroyMessage(message, (xdrproc_t)xdr_message);
+
+	/* Forged lengths fail the decoding instead of being allocated */
+	{
+		CMSetConverterF(descClient, (xdrproc_t)xdr_blob);
+		CMSetConverterF(descServer, (xdrproc_t)xdr_blob);
+		CMBlob blob;
+		const unsigned char forgedCount[8] = { 0x10, 0x00, 0x00, 0x00, 0, 0, 0, 0 };
+		const unsigned char forgedLength[8] = { 0, 0, 0, 0, 0x7f, 0xff, 0xff, 0xf0 };
+		WriteRecord(sockClient, forgedCount, sizeof(forgedCount));
+		memset(&blob, 0, sizeof(blob));
+		assert(CMReceiveMessage(descServer, &blob) == -1 && errno == EINVAL);
+		CMDestroyMessage(&blob, (xdrproc_t)xdr_blob);
+		WriteRecord(sockClient, forgedLength, sizeof(forgedLength));
+		memset(&blob, 0, sizeof(blob));
+		assert(CMReceiveMessage(descServer, &blob) == -1 && errno == EINVAL);
+		CMDestroyMessage(&blob, (xdrproc_t)xdr_blob);
+		
+		/* The decoded size limit applies to each item */
+		int values[3] = { 1, 2, 3 };
+		CMBlob sent = { 3, values, (u_int)strlen(string), (char *)string };
+		assert(CMSetReceiveLimits(descServer, 0, 2 * sizeof(int)) == 0);
+		assert(CMSendMessage(descClient, &sent) == 0);
+		memset(&blob, 0, sizeof(blob));
+		assert(CMReceiveMessage(descServer, &blob) == -1 && errno == EINVAL);
+		CMDestroyMessage(&blob, (xdrproc_t)xdr_blob);
+		assert(CMSetReceiveLimits(descServer, 0, 3 * sizeof(int)) == 0);
+		assert(CMSendMessage(descClient, &sent) == 0);
+		memset(&blob, 0, sizeof(blob));
+		assert(CMReceiveMessage(descServer, &blob) == 0 && blob.count == 3 && blob.values[2] == 3 && blob.length == strlen(string) && memcmp(blob.bytes, string, blob.length) == 0);
+		CMDestroyMessage(&blob, (xdrproc_t)xdr_blob);
+		assert(CMSetReceiveLimits(descServer, 0, 0) == 0);
+		
+		/* Streams of the caller are not limited, whatever they carry */
+		XDR xdrs;
+		char buffer[8];
+		xdrmem_create(&xdrs, buffer, sizeof(buffer), XDR_DECODE);
+		xdrs.x_public = (void *)buffer;
+		assert(CMDecodeLimit(&xdrs) == UINT_MAX && CMDecodeArrayLimit(&xdrs, sizeof(int), 4) == UINT_MAX);
+		xdr_destroy(&xdrs);
+		
+		CMSetConverterF(descClient, (xdrproc_t)xdr_message);
+		CMSetConverterF(descServer, (xdrproc_t)xdr_message);
+	}
+
+	/* A size hint too small falls back to the counting pass, an exact one is used as is */
+	{
+		size_t exactHint = 4 + 4 + 4 + ((strlen(string) + 3) & ~(size_t)3);
+		size_t hints[2] = { 8, exactHint };
+		for (int i=0; i<2; i++) {
+			message->type = 3 + i;
+			message->string = (char *)string;
+			assert(CMSendMessageWithSizeHint(descClient, message, hints[i]) == 0);
+			message->string = NULL;
+			assert(CMReceiveMessage(descServer, message) == 0 && message->type == 3 + i && strcmp(message->string, string) == 0);
+			CMDestroyMessage(message, (xdrproc_t)xdr_message);
+		}
+	}
+
+	/* Without flow control an empty message is sent and received like any other */
+	{
+		CMSetConverterF(descClient, (xdrproc_t)xdr_void);
+		CMSetConverterF(descServer, (xdrproc_t)xdr_void);
+		assert(CMSendMessage(descClient, message) == 0);
+		assert(CMReceiveMessage(descServer, message) == 0);
+		CMSetConverterF(descClient, (xdrproc_t)xdr_message);
+		CMSetConverterF(descServer, (xdrproc_t)xdr_message);
+		message->type = 5;
+		message->string = (char *)string;
+		assert(CMSendMessage(descClient, message) == 0);
+		message->string = NULL;
+		assert(CMReceiveMessage(descServer, message) == 0 && message->type == 5);
+		CMDestroyMessage(message, (xdrproc_t)xdr_message);
+	}
+
+	/* With a window of 2, the third message waits for the credit of the first */
+	assert(CMSetFlowControlWindow(descClient, 2) == 0);
+	assert(CMSetFlowControlWindow(descServer, 2) == 0);
+	CMSetConverterF(descClient, (xdrproc_t)xdr_void);
+	assert(CMSendMessage(descClient, message) == -1 && errno == EINVAL); /* It would be taken for a credit */
+	CMSetConverterF(descClient, (xdrproc_t)xdr_message);
+	for (int i=0; i<3; i++) {
+		message->type = 10 + i;
+		message->string = (char *)string;
+		assert(CMSendMessage(descClient, message) == 0);
+		if ( i == 1 ) {
+			message->string = NULL;
+			assert(CMReceiveMessage(descServer, message) == 0 && message->type == 10);
+			CMDestroyMessage(message, (xdrproc_t)xdr_message);
+		}
+	}
+	for (int i=1; i<3; i++) {
+		message->string = NULL;
+		assert(CMReceiveMessage(descServer, message) == 0 && message->type == 10 + i);
+		CMDestroyMessage(message, (xdrproc_t)xdr_message);
+	}
+
+	/* A peer ignoring the window makes the send waiting for credits fail, the messages kept are still received */
+	{
+		int sockets[2];
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+		int descPeer = CMInitCommunicationWithSocketAndConverter(sockets[1], (xdrproc_t)xdr_message);
+		assert(CMSetFlowControlWindow(descPeer, 2) == 0);
+		for (int i=0; i<3; i++) {
+			char body[64];
+			XDR xdrs;
+			message->type = 20 + i;
+			message->string = (char *)string;
+			xdrmem_create(&xdrs, body, sizeof(body), XDR_ENCODE);
+			assert(xdr_message(&xdrs, message));
+			WriteRecord(sockets[0], body, xdr_getpos(&xdrs));
+			xdr_destroy(&xdrs);
+		}
+		message->string = (char *)string;
+		assert(CMSendMessage(descPeer, message) == 0);
+		assert(CMSendMessage(descPeer, message) == 0);
+		assert(CMSendMessage(descPeer, message) == -1 && errno == EPROTO);
+		for (int i=0; i<2; i++) {
+			message->string = NULL;
+			assert(CMReceiveMessage(descPeer, message) == 0 && message->type == 20 + i);
+			CMDestroyMessage(message, (xdrproc_t)xdr_message);
+		}
+		CMFinishCommunicationWithCommunicationDescriptor(descPeer);
+		close(sockets[0]), close(sockets[1]);
+	}
+
+	/* A pipeline with several workers keeps the order of the messages of a descriptor */
+	{
+		int sockets[2];
+		char strings[100][64];
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+		int descPeer = CMInitCommunicationWithSocketAndConverter(sockets[0], (xdrproc_t)xdr_message);
+		int descPipeline = CMInitCommunicationWithSocketAndConverter(sockets[1], (xdrproc_t)xdr_message);
+		CMReceivePipeline *pipeline = CMCreateReceivePipeline(4, 100, sizeof(CMMessage), 1);
+		assert(pipeline != NULL && CMReceivePipelineAddCommunicationDescriptor(pipeline, descPipeline) == 0);
+		for (int i=0; i<100; i++) {
+			memset(strings[i], 'a' + i % 26, (size_t)(i % 63)), strings[i][i % 63] = '\0';
+			message->type = 100 + i;
+			message->string = strings[i];
+			assert(CMSendMessage(descPeer, message) == 0);
+		}
+		for (int i=0; i<100; i++) {
+			int from = -1;
+			message->string = NULL;
+			assert(CMReceivePipelineNextMessage(pipeline, &from, message) == 0 && from == descPipeline);
+			assert(message->type == 100 + i && strcmp(message->string, strings[i]) == 0);
+			CMDestroyMessage(message, (xdrproc_t)xdr_message);
+		}
+		CMDestroyReceivePipeline(pipeline);
+		CMFinishCommunicationWithCommunicationDescriptor(descPeer);
+		CMFinishCommunicationWithCommunicationDescriptor(descPipeline);
+		close(sockets[0]), close(sockets[1]);
+	}
+
+	/* The pipeline reader pauses at the backlog, reports records over the limit and the end of the stream */
+	{
+		int sockets[2];
+		char longString[128];
+		memset(longString, 'x', sizeof(longString) - 1), longString[sizeof(longString) - 1] = '\0';
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+		int descPeer = CMInitCommunicationWithSocketAndConverter(sockets[0], (xdrproc_t)xdr_message);
+		int descPipeline = CMInitCommunicationWithSocketAndConverter(sockets[1], (xdrproc_t)xdr_message);
+		assert(CMSetReceiveLimits(descPipeline, 64, 0) == 0);
+		for (int i=0; i<6; i++) {
+			message->type = 30 + i;
+			message->string = (i == 2) ? longString : (char *)string;
+			assert(CMSendMessage(descPeer, message) == 0);
+		}
+		CMReceivePipeline *pipeline = CMCreateReceivePipeline(2, 2, sizeof(CMMessage), 1);
+		assert(pipeline != NULL && CMReceivePipelineAddCommunicationDescriptor(pipeline, descPipeline) == 0);
+		sleep(1); /* Let the reader fill the backlog */
+		int unread = 0;
+		assert(ioctl(sockets[1], FIONREAD, &unread) == 0 && unread > 0);
+		for (int i=0; i<6; i++) {
+			int from = -1;
+			message->string = NULL;
+			if ( i == 2 ) {
+				assert(CMReceivePipelineNextMessage(pipeline, &from, message) == -1 && errno == EMSGSIZE && from == descPipeline);
+				continue;
+			}
+			assert(CMReceivePipelineNextMessage(pipeline, &from, message) == 0 && from == descPipeline && message->type == 30 + i);
+			CMDestroyMessage(message, (xdrproc_t)xdr_message);
+		}
+		shutdown(sockets[0], SHUT_WR);
+		assert(CMReceivePipelineNextMessage(pipeline, NULL, message) == -1 && errno == EPIPE);
+		CMDestroyReceivePipeline(pipeline);
+		CMFinishCommunicationWithCommunicationDescriptor(descPeer);
+		CMFinishCommunicationWithCommunicationDescriptor(descPipeline);
+		close(sockets[0]), close(sockets[1]);
+	}
+
+	/* The end of the stream is still reported after a record over the limit */
+	{
+		int sockets[2];
+		char body[64];
+		memset(body, 0, sizeof(body));
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+		int descPeer = CMInitCommunicationWithSocketAndConverter(sockets[1], (xdrproc_t)xdr_message);
+		assert(CMSetReceiveLimits(descPeer, 16, 0) == 0);
+		WriteRecord(sockets[0], body, sizeof(body));
+		shutdown(sockets[0], SHUT_WR);
+		message->string = NULL;
+		assert(CMReceiveMessage(descPeer, message) == -1 && errno == EMSGSIZE);
+		assert(CMReceiveMessage(descPeer, message) == -1 && errno == ECONNRESET);
+		assert(CMReceiveMessage(descPeer, message) == -1 && errno == ECONNRESET);
+		CMFinishCommunicationWithCommunicationDescriptor(descPeer);
+		close(sockets[0]), close(sockets[1]);
+	}
 		
 	CMFinishCommunicationWithCommunicationDescriptor(descClient);
 	CMFinishCommunicationWithCommunicationDescriptor(descServer);
@@ -182,6 +414,13 @@ int InitConnexion(const char *hostname, int port) {
 }
 
 
+void WriteRecord(int socket, const void *body, size_t length) {
+	/* A single fragment record, written as is by a peer */
+	uint32_t mark = htonl(0x80000000U | (uint32_t)length);
+	assert(write(socket, &mark, sizeof(mark)) == (ssize_t)sizeof(mark));
+	assert(write(socket, body, length) == (ssize_t)length);
+}
+
 bool_t xdr_message(XDR *xdrs, const void *mesg) {
 	CMMessage *message = (CMMessage *)mesg;
 	int length = 0;
@@ -196,7 +435,11 @@ bool_t xdr_message(XDR *xdrs, const void *mesg) {
 			);
 }
 
-
-
-
-
+bool_t xdr_blob(XDR *xdrs, const void *b) {
+	CMBlob *blob = (CMBlob *)b;
+	return (
+			xdr_array(xdrs, (char **)&(blob->values), &(blob->count), CMDecodeArrayLimit(xdrs, sizeof(int), 4), sizeof(int), (xdrproc_t)xdr_int)
+			&&
+			xdr_bytes(xdrs, &(blob->bytes), &(blob->length), CMDecodeLimit(xdrs))
+			);
+}